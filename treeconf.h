@@ -56,6 +56,8 @@ namespace treeconf {
   class TokenImpl;
   class Token {
     friend class TokenImpl;
+    friend class ImportImpl;
+    friend class PlanImpl;
     TokenImpl *pimpl_;
     Token(const Token&);
   public:
@@ -69,6 +71,10 @@ namespace treeconf {
     const char* completions(bool withhelp = false) const;
     void push(Token* tok);
     const Result parse(int argc, char* argv[]) throw (Result, TokenException);
+    // Set flags pushed onto this token, bit Flag::getBit() of word 0, 1...
+    // Like Argument text, the bits are kept on the token by the last
+    // parse, so parses of one tree must not overlap.
+    unsigned long getFlags(unsigned int word = 0) const;
   protected:
     virtual const Result parse_w(int argc, char* argv[], Token* root = NULL, const char* history = NULL) throw (Result, TokenException);
     TokenImpl *getPimpl() { return pimpl_; }
@@ -78,6 +84,7 @@ namespace treeconf {
   
   class ArgumentImpl;
   class Argument : public Token {
+    friend class PlanImpl;
     ArgumentImpl *pimpl_;
     Argument (const Argument&);
   protected:
@@ -96,13 +103,14 @@ namespace treeconf {
     FlagImpl *pimpl_;
     Flag (const Flag&);
   protected:
-    void init();
+    void addTo(Token* tok);
     const Result parse_w(int argc, char* argv[], Token* root = NULL, const char* history = NULL) throw (Result, TokenException);
   public:
     Flag(const char* name, const char* help = NULL, bool mayTerminate = false);
     virtual ~Flag();
 
     bool isSet() const;
+    unsigned int getBit() const;
   };
   
 
@@ -118,6 +126,62 @@ namespace treeconf {
 
   };
 
+  // Splits a line of text at blanks into the argc/argv that Token::parse
+  // takes, with the root's name as argv[0]. The words stay valid until
+  // the next split().
+  class CommandLineImpl;
+  class CommandLine {
+    CommandLineImpl* pimpl_;
+    CommandLine(const CommandLine&);
+  public:
+    CommandLine();
+    virtual ~CommandLine();
+
+    int split(const Token* root, const char* begin, const char* end);
+    char** getArgv();
+  };
+
+  // Bulk import of a file holding one command line per line. The file is
+  // mapped and split at line boundaries into chunks that are tokenized and
+  // validated against the tree in parallel. If dispatch is requested, valid
+  // lines are then parsed through the tree (running its commands) in file
+  // order. Blank lines and lines starting with '#' are skipped.
+  class ImportImpl;
+  class Import {
+    ImportImpl* pimpl_;
+    Import(const Import&);
+  public:
+    Import(Token* root, unsigned int threads = 0);
+    virtual ~Import();
+
+    const Result load(const char* path, bool dispatch = false) throw (Result);
+    size_t getLines() const;
+    size_t getErrors() const;
+    size_t getErrorLine(size_t i) const;
+    const char* getError(size_t i) const;
+  };
+
+  // A command line parsed once and kept as the path of tokens it reached,
+  // much like a prepared statement. Between runs only the words taken by
+  // Arguments can change, through bind(); run() then resets the tree as a
+  // parse would, sets the state of the tokens on the path and runs its
+  // commands, innermost first, without matching any word again. The plan
+  // must be prepared again if the tree changes.
+  class PlanImpl;
+  class Plan {
+    PlanImpl* pimpl_;
+    Plan(const Plan&);
+  public:
+    Plan(Token* root);
+    virtual ~Plan();
+
+    void prepare(int argc, char* argv[]) throw (Result, TokenException);
+    unsigned int getArguments() const;
+    const Argument* getArgument(unsigned int i) const;
+    void bind(unsigned int i, const char* value) throw (Result);
+    const Result run() throw (Result, TokenException);
+  };
+
   #ifndef NO_TEMPLATES
   template <typename C>
   C convertTo(const char* txt);
@@ -0,0 +1,318 @@
+#include "treeconf_server.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace treeconf {
+
+  // Server implementation
+  //
+  struct ServerClient {
+    int fd_;
+    string in_;
+    string out_;
+    size_t outPos_;
+    bool reading_;              // false while out_ is over the backlog limit
+    bool closing_;              // peer is done sending, drop once out_ is flushed
+    ServerClient(int fd) : fd_(fd), outPos_(0), reading_(true), closing_(false) {}
+  };
+  typedef map<int, ServerClient*> ServerClientMap;
+
+  class ServerImpl {
+    friend class Server;
+    static const size_t MAX_LINE = 1 << 16;
+    static const size_t MAX_BACKLOG = 1 << 20;
+    static const int MAX_EVENTS = 256;
+    static const int MAX_PAUSE = 1000;   // ms
+
+    Token* root_;
+    string path_;
+    unsigned int maxClients_;
+    int listenFd_;
+    int epollFd_;
+    int wakeFd_;
+    volatile bool running_;
+    bool paused_;               // not accepting for lack of descriptors
+    ServerClientMap clients_;
+    CommandLine line_;
+
+    ServerImpl(Token* root, const char* path, unsigned int maxClients)
+      : root_(root), path_(path), maxClients_(maxClients),
+        listenFd_(-1), epollFd_(-1), wakeFd_(-1), running_(false), paused_(false) {}
+
+    ~ServerImpl() {
+      for (ServerClientMap::iterator i = clients_.begin(); i != clients_.end(); i++) {
+        close(i->first);
+        delete i->second;
+      }
+      if (listenFd_ >= 0) {
+        close(listenFd_);
+        unlink(path_.c_str());
+      }
+      if (epollFd_ >= 0) close(epollFd_);
+      if (wakeFd_ >= 0) close(wakeFd_);
+    }
+
+    static Result failure(const string& what) {
+      return Result(Result::FAILURE_CODE, (what + ": " + strerror(errno)).c_str());
+    }
+
+    void watch(int op, int fd, unsigned int events, void* ptr) throw (Result) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = events;
+      ev.data.ptr = ptr;
+      if (epoll_ctl(epollFd_, op, fd, &ev) < 0)
+        throw failure("Cannot watch descriptor");
+    }
+
+    void listen() throw (Result) {
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (path_.size() >= sizeof(addr.sun_path))
+        throw Result(Result::FAILURE_CODE, ("Socket path too long: \"" + path_ + "\"").c_str());
+      strcpy(addr.sun_path, path_.c_str());
+
+      // Only ever replace a stale socket, never some other file
+      struct stat st;
+      if (stat(path_.c_str(), &st) == 0 and S_ISSOCK(st.st_mode))
+        unlink(path_.c_str());
+
+      epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+      if (epollFd_ < 0) throw failure("Cannot create epoll instance");
+      wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (wakeFd_ < 0) throw failure("Cannot create eventfd");
+      int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd < 0) throw failure("Cannot create socket");
+      if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        throw failure("Cannot bind \"" + path_ + "\"");
+      }
+      listenFd_ = fd;
+      if (::listen(listenFd_, SOMAXCONN) < 0)
+        throw failure("Cannot listen on \"" + path_ + "\"");
+      watch(EPOLL_CTL_ADD, listenFd_, EPOLLIN, &listenFd_);
+      watch(EPOLL_CTL_ADD, wakeFd_, EPOLLIN, &wakeFd_);
+    }
+
+    void accept() throw (Result) {
+      for (;;) {
+        int fd = accept4(listenFd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+          if (errno == EINTR or errno == ECONNABORTED) continue;
+          if (errno == EAGAIN or errno == EWOULDBLOCK) return;
+          if (errno == EMFILE or errno == ENFILE) {
+            // The listening socket stays readable, so stop watching it
+            // until a descriptor is freed
+            pause(true);
+            return;
+          }
+          throw failure("Cannot accept connection");
+        }
+        if (clients_.size() >= maxClients_) {
+          close(fd);
+          continue;
+        }
+        ServerClient* client = new ServerClient(fd);
+        clients_[fd] = client;
+        watch(EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLRDHUP, client);
+      }
+    }
+
+    void pause(bool paused) throw (Result) {
+      if (paused == paused_) return;
+      watch(EPOLL_CTL_MOD, listenFd_, paused ? 0U : (unsigned int)EPOLLIN, &listenFd_);
+      paused_ = paused;
+    }
+
+    void drop(ServerClient* client) throw (Result) {
+      clients_.erase(client->fd_);
+      close(client->fd_);
+      delete client;
+      pause(false);
+    }
+
+    static void respond(ServerClient* client, int code, const string& what) {
+      stringstream ss;
+      ss << code << " ";
+      client->out_ += ss.str();
+      size_t start = client->out_.size();
+      client->out_ += what;
+      for (size_t i = start; i < client->out_.size(); i++)
+        if (client->out_[i] == '\n') client->out_[i] = ' ';
+      client->out_ += '\n';
+    }
+
+    void dispatch(ServerClient* client, const char* b, const char* e) {
+      int argc = line_.split(root_, b, e);
+      try {
+        const Result retval = root_->parse(argc, line_.getArgv());
+        respond(client, retval.getCode(), retval.what());
+      } catch (ParseException& ex) {
+        respond(client, Result::FAILURE_CODE, string(ex.what()) + " after \"" + ex.where()->getName() + "\"");
+      } catch (RunException& ex) {
+        respond(client, Result::FAILURE_CODE, string(ex.what()) + " for command \"" + ex.where()->getName() + "\"");
+      } catch (Result& ex) {
+        respond(client, ex.getCode(), ex.what());
+      }
+    }
+
+    // Dispatches complete lines until the response backlog is full.
+    // Returns false if the client sent a line that is too long.
+    bool process(ServerClient* client) {
+      const char* data = client->in_.data();
+      size_t size = client->in_.size();
+      size_t pos = 0;
+      while (client->out_.size() - client->outPos_ < MAX_BACKLOG) {
+        const char* nl = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+        if (!nl) break;
+        dispatch(client, data + pos, nl);
+        pos = nl - data + 1;
+      }
+      client->in_.erase(0, pos);
+      return client->in_.size() <= MAX_LINE or hasLine(client);
+    }
+
+    // Returns false once the peer is gone
+    bool flush(ServerClient* client) {
+      while (client->outPos_ < client->out_.size()) {
+        ssize_t n = send(client->fd_, client->out_.data() + client->outPos_,
+                         client->out_.size() - client->outPos_, MSG_NOSIGNAL);
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          if (errno == EAGAIN or errno == EWOULDBLOCK) break;
+          return false;
+        }
+        client->outPos_ += n;
+      }
+      // A client that keeps pipelining may never let out_ drain, so drop
+      // the sent part once it is as large as the backlog limit
+      if (client->outPos_ == client->out_.size())
+        client->out_.clear();
+      else if (client->outPos_ >= MAX_BACKLOG)
+        client->out_.erase(0, client->outPos_);
+      else
+        return true;
+      client->outPos_ = 0;
+      return true;
+    }
+
+    static bool hasLine(const ServerClient* client) {
+      return memchr(client->in_.data(), '\n', client->in_.size()) != NULL;
+    }
+
+    void update(ServerClient* client) throw (Result) {
+      client->reading_ = !client->closing_ and client->out_.size() - client->outPos_ < MAX_BACKLOG;
+      // RDHUP stays reported until read() sees the end of input, so it is
+      // only watched together with EPOLLIN
+      unsigned int events = 0;
+      if (client->reading_) events |= EPOLLIN | EPOLLRDHUP;
+      if (client->outPos_ < client->out_.size()) events |= EPOLLOUT;
+      watch(EPOLL_CTL_MOD, client->fd_, events, client);
+    }
+
+    void serve(ServerClient* client, unsigned int events) throw (Result) {
+      if (events & EPOLLERR) {
+        drop(client);
+        return;
+      }
+      if (client->reading_ and (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        char chunk[16384];
+        ssize_t n = read(client->fd_, chunk, sizeof(chunk));
+        if (n > 0)
+          client->in_.append(chunk, n);
+        else if (n == 0) {
+          // An unterminated last line is still a request
+          if (!client->in_.empty() and client->in_[client->in_.size() - 1] != '\n')
+            client->in_ += '\n';
+          client->closing_ = true;
+        }
+        else if (errno != EINTR and errno != EAGAIN and errno != EWOULDBLOCK) {
+          drop(client);
+          return;
+        }
+      }
+      // Lines held back by a full backlog are picked up as soon as
+      // flush() makes room for their responses
+      bool ok;
+      do {
+        ok = process(client);
+        if (!ok) {
+          respond(client, Result::FAILURE_CODE, "Line too long");
+          client->in_.clear();
+          client->closing_ = true;
+        }
+        if (!flush(client)) {
+          drop(client);
+          return;
+        }
+      } while (ok and client->out_.empty() and hasLine(client));
+      if (client->closing_ and client->out_.empty()) {
+        drop(client);
+        return;
+      }
+      update(client);
+    }
+
+    void poll(int timeout) throw (Result) {
+      struct epoll_event events[MAX_EVENTS];
+      // Descriptors may also be freed outside the server, so retry
+      // accepting now and then even if no client goes away
+      if (paused_ and (timeout < 0 or timeout > MAX_PAUSE)) timeout = MAX_PAUSE;
+      int n = epoll_wait(epollFd_, events, MAX_EVENTS, timeout);
+      if (paused_) pause(false);
+      if (n < 0) {
+        if (errno == EINTR) return;
+        throw failure("Cannot wait for events");
+      }
+      for (int i = 0; i < n; i++) {
+        void* ptr = events[i].data.ptr;
+        if (ptr == &listenFd_)
+          accept();
+        else if (ptr == &wakeFd_) {
+          uint64_t count;
+          if (read(wakeFd_, &count, sizeof(count)) < 0) {}
+        } else
+          serve(static_cast<ServerClient*>(ptr), events[i].events);
+      }
+    }
+
+    void run() throw (Result) {
+      if (listenFd_ < 0) listen();
+      running_ = true;
+      while (running_)
+        poll(-1);
+    }
+
+    void stop() {
+      running_ = false;
+      uint64_t one = 1;
+      if (wakeFd_ >= 0 and write(wakeFd_, &one, sizeof(one)) < 0) {}
+    }
+  };
+  Server::Server(Token* root, const char* path, unsigned int maxClients)
+    : pimpl_(new ServerImpl(root, path, maxClients)) {}
+  Server::~Server() { delete pimpl_; }
+  void Server::listen() throw (Result) { pimpl_->listen(); }
+  void Server::poll(int timeout) throw (Result) { pimpl_->poll(timeout); }
+  void Server::run() throw (Result) { pimpl_->run(); }
+  void Server::stop() { pimpl_->stop(); }
+  const char* Server::getPath() const { return pimpl_->path_.c_str(); }
+  unsigned int Server::getClients() const { return pimpl_->clients_.size(); }
+
+}
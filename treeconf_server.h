@@ -0,0 +1,34 @@
+// -*- mode: c++ -*-
+
+#ifndef TREECONF_SERVER_H
+#define TREECONF_SERVER_H
+
+#include "treeconf.h"
+
+namespace treeconf {
+
+  // Serves a token tree over a UNIX-domain stream socket. Clients send
+  // newline-terminated command lines and may pipeline as many as they
+  // like; every line gets exactly one "<code> <what>\n" response, in
+  // order. All clients are multiplexed with epoll on the thread calling
+  // run() or poll(), so the tree is only ever parsed from that thread.
+  class ServerImpl;
+  class Server {
+    ServerImpl* pimpl_;
+    Server(const Server&);
+  public:
+    Server(Token* root, const char* path, unsigned int maxClients = 4096);
+    virtual ~Server();
+
+    void listen() throw (Result);
+    void poll(int timeout = -1) throw (Result);
+    void run() throw (Result);
+    void stop();
+
+    const char* getPath() const;
+    unsigned int getClients() const;
+  };
+
+}
+
+#endif // TREECONF_SERVER_H
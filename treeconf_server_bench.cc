@@ -0,0 +1,183 @@
+// Local load generator for treeconf::Server.
+//
+//   g++ -O2 treeconf_server_bench.cc treeconf_server.cc treeconf_stl_impl.cc -lpthread
+//   ./a.out [clients] [requests per client] [pipeline depth]
+//
+// Each client keeps up to <depth> requests in flight on its own
+// connection and times every request from send to response.
+
+#include "treeconf_server.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace treeconf;
+
+class Dim : public Command {
+  Argument value_;
+public:
+  Dim() : Command("dim", "Dim lights"), value_("<dim_value>") { push(&value_); }
+  const Result run() throw (Result, RunException) { return Result::SUCCESS; }
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct Client {
+  pthread_t tid;
+  const char* path;
+  int requests;
+  int depth;
+  int failures;
+  vector<double> latencies;
+};
+
+static void* serve(void* arg) {
+  try {
+    static_cast<Server*>(arg)->run();
+  } catch (Result& e) {
+    cerr << "Server failed: " << e.what() << "\n";
+  }
+  return NULL;
+}
+
+static void* load(void* arg) {
+  Client* c = static_cast<Client*>(arg);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+  if (fd < 0 or connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+    perror("connect");
+    c->failures = c->requests;
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+
+  deque<double> inflight;
+  string out, in;
+  char chunk[16384];
+  int sent = 0, received = 0;
+  while (received < c->requests) {
+    out.clear();
+    for (; sent < c->requests and (int)inflight.size() < c->depth; sent++) {
+      stringstream ss;
+      ss << "lamp" << sent % 4 << " dim " << sent % 100 << "\n";
+      out += ss.str();
+      inflight.push_back(now());
+    }
+    bool written = true;
+    for (size_t pos = 0; written and pos < out.size(); ) {
+      ssize_t n = write(fd, out.data() + pos, out.size() - pos);
+      if (n <= 0) { perror("write"); written = false; }
+      else pos += n;
+    }
+    if (!written) break;
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n <= 0) { perror("read"); break; }
+    in.append(chunk, n);
+    size_t pos = 0, nl;
+    while ((nl = in.find('\n', pos)) != string::npos) {
+      c->latencies.push_back(now() - inflight.front());
+      inflight.pop_front();
+      if (in.compare(pos, 2, "0 ") != 0) c->failures++;
+      received++;
+      pos = nl + 1;
+    }
+    in.erase(0, pos);
+  }
+  // Requests never sent or never answered count as failed too
+  c->failures += c->requests - received;
+  close(fd);
+  return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+  int clients = argc > 1 ? atoi(argv[1]) : 64;
+  int requests = argc > 2 ? atoi(argv[2]) : 10000;
+  int depth = argc > 3 ? atoi(argv[3]) : 16;
+
+  Token root("bench");
+  vector<Token*> lamps;
+  vector<Dim*> dims;
+  for (int i = 0; i < 4; i++) {
+    stringstream ss;
+    ss << "lamp" << i;
+    lamps.push_back(new Token(ss.str().c_str()));
+    dims.push_back(new Dim());
+    lamps.back()->push(dims.back());
+    root.push(lamps.back());
+  }
+
+  stringstream path;
+  path << "/tmp/treeconf_bench." << getpid();
+  Server server(&root, path.str().c_str());
+  try {
+    server.listen();
+  } catch (Result& e) {
+    cerr << e.what() << "\n";
+    return 1;
+  }
+  pthread_t stid;
+  pthread_create(&stid, NULL, serve, &server);
+
+  vector<Client> loads(clients);
+  double start = now();
+  for (int i = 0; i < clients; i++) {
+    loads[i].path = server.getPath();
+    loads[i].requests = requests;
+    loads[i].depth = depth;
+    loads[i].failures = 0;
+    loads[i].latencies.reserve(requests);
+    pthread_create(&loads[i].tid, NULL, load, &loads[i]);
+  }
+  vector<double> latencies;
+  int failures = 0;
+  for (int i = 0; i < clients; i++) {
+    pthread_join(loads[i].tid, NULL);
+    latencies.insert(latencies.end(), loads[i].latencies.begin(), loads[i].latencies.end());
+    failures += loads[i].failures;
+  }
+  double elapsed = now() - start;
+
+  server.stop();
+  pthread_join(stid, NULL);
+
+  sort(latencies.begin(), latencies.end());
+  size_t n = latencies.size();
+  cout << clients << " clients, " << requests << " requests each, depth " << depth << "\n";
+  cout << n << " responses (" << failures << " failed) in " << elapsed << " s: "
+       << (size_t)(n / elapsed) << " requests/s\n";
+  if (n) {
+    cout << "latency us: p50 " << latencies[n / 2] * 1e6
+         << "  p99 " << latencies[n * 99 / 100] * 1e6
+         << "  p99.9 " << latencies[n * 999 / 1000] * 1e6
+         << "  max " << latencies[n - 1] * 1e6 << "\n";
+  }
+
+  for (size_t i = 0; i < lamps.size(); i++) {
+    delete dims[i];
+    delete lamps[i];
+  }
+  return failures ? 1 : 0;
+}
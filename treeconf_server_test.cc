@@ -0,0 +1,290 @@
+// Functional checks for treeconf::Server.
+//
+//   g++ treeconf_server_test.cc treeconf_server.cc treeconf_stl_impl.cc -lpthread
+//   ./a.out
+
+#include "treeconf_server.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace treeconf;
+
+class Dim : public Command {
+  Argument value_;
+public:
+  Dim() : Command("dim", "Dim lights"), value_("<dim_value>") { push(&value_); }
+  const Result run() throw (Result, RunException) {
+    return Result(Result::SUCCESS_CODE, (string("dimmed ") + value_.getText()).c_str());
+  }
+};
+
+// Answers far more than it is asked, to put the server under backpressure
+class Big : public Command {
+public:
+  Big() : Command("big", "Long response") {}
+  const Result run() throw (Result, RunException) {
+    return Result(Result::SUCCESS_CODE, string(1000, 'b').c_str());
+  }
+};
+
+int check(bool ok, const string& what) {
+  if (!ok) cerr << "FAILED: " << what << "\n";
+  return ok ? 0 : 1;
+}
+
+int connectTo(const char* path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+    perror("connect");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void writeAll(int fd, const string& data) {
+  for (size_t pos = 0; pos < data.size(); ) {
+    ssize_t n = write(fd, data.data() + pos, data.size() - pos);
+    if (n <= 0) return;
+    pos += n;
+  }
+}
+
+// Reads until the server closes the connection, or sends far more than
+// any test asks for, pausing after every pauseEvery bytes if that is given
+vector<string> readLines(int fd, size_t pauseEvery = 0) {
+  vector<string> lines;
+  string in;
+  char chunk[16384];
+  ssize_t n;
+  while (in.size() < (64 << 20) and (n = read(fd, chunk, sizeof(chunk))) > 0) {
+    if (pauseEvery and in.size() / pauseEvery != (in.size() + n) / pauseEvery)
+      usleep(100000);
+    in.append(chunk, n);
+  }
+  stringstream ss(in);
+  string line;
+  while (getline(ss, line))
+    lines.push_back(line);
+  return lines;
+}
+
+double cpuTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void* serve(void* arg) {
+  try {
+    static_cast<Server*>(arg)->run();
+  } catch (Result& e) {
+    cerr << "Server failed: " << e.what() << "\n";
+  }
+  return NULL;
+}
+
+struct Writer {
+  int fd;
+  string data;
+};
+
+void* writeHalfClose(void* arg) {
+  Writer* w = static_cast<Writer*>(arg);
+  writeAll(w->fd, w->data);
+  shutdown(w->fd, SHUT_WR);
+  return NULL;
+}
+
+string numbered(int count) {
+  stringstream ss;
+  for (int i = 0; i < count; i++)
+    ss << "lamp1 dim " << i << "\n";
+  return ss.str();
+}
+
+int checkNumbered(const vector<string>& lines, int count, const char* what) {
+  int failures = check((int)lines.size() == count, string(what) + ": one response per request");
+  for (int i = 0; i < count and i < (int)lines.size(); i++) {
+    stringstream ss;
+    ss << "0 dimmed " << i;
+    if (lines[i] != ss.str())
+      return failures + check(false, string(what) + ": responses in request order");
+  }
+  return failures;
+}
+
+int testPipelined(const char* path) {
+  cout << "Pipelined requests\n";
+  int fd = connectTo(path);
+  if (fd < 0) return 1;
+  writeAll(fd, "lamp1 dim 1\nlamp2\n\nlamp1 di");
+  usleep(50000);
+  writeAll(fd, "m 2\nlamp1 dim 3");
+  shutdown(fd, SHUT_WR);
+  vector<string> lines = readLines(fd);
+  close(fd);
+
+  const char* expected[] = { "0 dimmed 1", "-1 Not enough arguments after \"lamp2\"",
+                             "-1 Not enough arguments after \"lighting\"", "0 dimmed 2", "0 dimmed 3" };
+  int failures = check(lines.size() == 5, "one response per line, split writes and unterminated last line included");
+  for (size_t i = 0; i < 5 and i < lines.size(); i++)
+    failures += check(lines[i] == expected[i], "response \"" + lines[i] + "\" should be \"" + expected[i] + "\"");
+  return failures;
+}
+
+string repeated(const string& line, int count) {
+  string s;
+  for (int i = 0; i < count; i++)
+    s += line;
+  return s;
+}
+
+int testBackpressure(const char* path) {
+  cout << "Backpressure\n";
+  const int count = 200000;
+  int fd = connectTo(path);
+  if (fd < 0) return 1;
+  Writer w = { fd, numbered(count) };
+  pthread_t tid;
+  pthread_create(&tid, NULL, writeHalfClose, &w);
+  usleep(200000);
+  vector<string> lines = readLines(fd);
+  pthread_join(tid, NULL);
+  close(fd);
+  return checkNumbered(lines, count, "backpressure");
+}
+
+int testHalfClosed(const char* path) {
+  cout << "Half closed under backpressure\n";
+  const int count = 2000;
+  int fd = connectTo(path);
+  if (fd < 0) return 1;
+  // The requests fit in the socket buffers, their responses do not
+  writeAll(fd, repeated("lamp1 big\n", count));
+  shutdown(fd, SHUT_WR);
+  usleep(200000);
+  double before = cpuTime();
+  usleep(1000000);
+  double spent = cpuTime() - before;
+  vector<string> lines = readLines(fd);
+  close(fd);
+  int failures = check(spent < 0.2, "server stays idle while a half-closed client does not read");
+  failures += check((int)lines.size() == count, "half-closed client gets every response");
+  return failures;
+}
+
+int testLineTooLong(const char* path) {
+  cout << "Line too long\n";
+  int fd = connectTo(path);
+  if (fd < 0) return 1;
+  // Fill the response backlog first and stop reading once the server
+  // takes in the long line, so the rejection is flushed in parts
+  const int count = 2000;
+  Writer w = { fd, repeated("lamp1 big\n", count) + string(100000, 'x') };
+  pthread_t tid;
+  pthread_create(&tid, NULL, writeHalfClose, &w);
+  usleep(200000);
+  vector<string> lines = readLines(fd, 200000);
+  pthread_join(tid, NULL);
+  close(fd);
+  int rejected = 0;
+  for (size_t i = 0; i < lines.size(); i++)
+    if (lines[i] == "-1 Line too long") rejected++;
+  int failures = check((int)lines.size() == count + 1, "line too long: one response per request");
+  return failures + check(rejected == 1 and lines.back() == "-1 Line too long", "a line too long is rejected exactly once");
+}
+
+long residentBytes() {
+  long pages = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+int testSteadyPipeline(const char* path) {
+  cout << "Steady pipelined client\n";
+  // About 100MB of responses to a client that reads steadily but a
+  // little slower than the server answers, so its queue never drains
+  const int count = 100000;
+  int fd = connectTo(path);
+  if (fd < 0) return 1;
+  Writer w = { fd, repeated("lamp1 big\n", count) };
+  pthread_t tid;
+  pthread_create(&tid, NULL, writeHalfClose, &w);
+  long before = residentBytes();
+  long grown = -1;
+  int received = 0;
+  char chunk[16384];
+  ssize_t n;
+  while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+    usleep(100);
+    received += std::count(chunk, chunk + n, '\n');
+    if (received > count * 9 / 10 and grown < 0)
+      grown = residentBytes() - before;
+  }
+  pthread_join(tid, NULL);
+  close(fd);
+  int failures = check(received == count, "steady client gets every response");
+  return failures + check(grown < (32 << 20), "server memory stays bounded for a steady pipelined client");
+}
+
+int
+main()
+{
+  Token root("lighting");
+  Token lamp1("lamp1");
+  Token lamp2("lamp2");
+  Dim dim1;
+  Dim dim2;
+  Big big;
+  lamp1.push(&big);
+  lamp1.push(&dim1);
+  lamp2.push(&dim2);
+  root.push(&lamp1);
+  root.push(&lamp2);
+
+  stringstream path;
+  path << "/tmp/treeconf_server_test." << getpid();
+  Server server(&root, path.str().c_str());
+  try {
+    server.listen();
+  } catch (Result& e) {
+    cerr << e.what() << "\n";
+    return 1;
+  }
+  pthread_t stid;
+  pthread_create(&stid, NULL, serve, &server);
+
+  int failures = 0;
+  failures += testPipelined(server.getPath());
+  failures += testBackpressure(server.getPath());
+  failures += testHalfClosed(server.getPath());
+  failures += testLineTooLong(server.getPath());
+  failures += testSteadyPipeline(server.getPath());
+
+  server.stop();
+  pthread_join(stid, NULL);
+  cout << (failures ? "FAILED\n" : "OK\n");
+  return failures ? 1 : 0;
+}
@@ -1,5 +1,14 @@
 #include "treeconf.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 #include <sstream>
@@ -88,9 +97,23 @@ namespace treeconf {
 
   // Token implementation
   //
+  // A token reached while preparing a Plan, with the word it took and
+  // the flags it was given
+  struct PlanStep {
+    Token* token_;
+    string text_;
+    vector<unsigned long> flags_;
+    PlanStep(Token* token, const char* text, size_t words) : token_(token), text_(text), flags_(words, 0) {}
+  };
+  typedef vector<PlanStep> PlanPath;
+
+  // Flags per word of a token's flag bitset, see Token::getFlags()
+  static const unsigned int FLAG_WORD_BITS = sizeof(unsigned long) * CHAR_BIT;
+
   class TokenImpl;
   typedef Token* TokenPtr;
   typedef vector<TokenPtr> TokenVector;
+  typedef vector<Flag*> FlagVector;
   class TokenImpl {
     friend class Token;
     const string name_;
@@ -98,9 +121,14 @@ namespace treeconf {
     string help_;
     
     Argument* argchild_;
+    Argument* argument_;                // this token, if it is an Argument
+    Command* command_;                  // this token, if it is a Command
     TokenVector children_;
+    FlagVector flags_;                  // also in children_, in push order
+    vector<unsigned long> flagBits_;    // one bit per entry of flags_
 
-    TokenImpl (const char *name, const char *help, bool mayTerminate) : name_(name), mayTerminate_(mayTerminate), argchild_(NULL){
+    TokenImpl (const char *name, const char *help, bool mayTerminate)
+      : name_(name), mayTerminate_(mayTerminate), argchild_(NULL), argument_(NULL), command_(NULL) {
       if (help != NULL) help_.assign(help);
     }
     ~TokenImpl () { }
@@ -131,34 +159,151 @@ namespace treeconf {
         ss << "  ";
       return ss.str();
     }
-      
+
+    // Bare flags of this token, i.e. flags without children of their own,
+    // are taken in one step from the words following the token: by name
+    // ("-a", "--all") or bundled ("-abc" for "-a", "-b" and "-c").
+    // Their bits are set in bits, if given. Returns the number of words taken.
+    int takeFlags(int argc, char* argv[], vector<unsigned long>* bits) const {
+      int taken = 0;
+      for (int i = 1; i < argc and argv[i][0] == '-'; i++, taken++) {
+        int bit = findFlag(argv[i]);
+        if (bit >= 0) {
+          if (bits) setBit(*bits, bit);
+        } else if (argv[i][1] == '-' or argv[i][1] == '\0' or !takeBundle(argv[i], bits))
+          break;
+      }
+      return taken;
+    }
+
+    int findFlag(const char* word) const {
+      for (FlagVector::const_iterator i = flags_.begin(); i != flags_.end(); i++) {
+        const TokenImpl* flag = static_cast<const Token*>(*i)->pimpl_;
+        if (flag->isBare() and strcmp(flag->getName(), word) == 0)
+          return i - flags_.begin();
+      }
+      return -1;
+    }
+
+    bool takeBundle(const char* word, vector<unsigned long>* bits) const {
+      char name[3] = { '-', '\0', '\0' };
+      for (const char* c = word + 1; *c; c++) {
+        name[1] = *c;
+        if (findFlag(name) < 0) return false;
+      }
+      for (const char* c = word + 1; bits and *c; c++) {
+        name[1] = *c;
+        setBit(*bits, findFlag(name));
+      }
+      return true;
+    }
+
+    static void setBit(vector<unsigned long>& bits, unsigned int bit) {
+      bits[bit / FLAG_WORD_BITS] |= 1UL << (bit % FLAG_WORD_BITS);
+    }
+
+    bool isBare() const { return children_.empty() and !argchild_; }
+
+    Token* findChild(const char* word) const {
+      for (TokenVector::const_iterator i = children_.begin(); i != children_.end(); i++) {
+        if (strcmp((*i)->getName(), word) == 0)
+          return *i;
+      }
+      return NULL;
+    }
+
+    // Splits "--name=value" into words when a child is called "--name"
+    Token* findAssignment(const char* word, vector<char>& buf, vector<char*>& words) const {
+      const char* eq = strchr(word, '=');
+      if (word[0] != '-' or word[1] != '-' or !eq) return NULL;
+      buf.assign(word, word + strlen(word) + 1);
+      buf[eq - word] = '\0';
+      Token* child = findChild(&buf[0]);
+      if (child) {
+        words.push_back(&buf[0]);
+        words.push_back(&buf[eq - word + 1]);
+      }
+      return child;
+    }
+
   public:
     
     const Result parse_w(Token* where, int argc, char* argv[], Token* root, const char* history = NULL) throw (Result, TokenException){
-      if (argc >= 2) {
+      int next = 1 + takeFlags(argc, argv, &flagBits_);
+      if (argc > next) {
         string stack;
         if (history != NULL) {
           stack.assign(history);
           stack += " ";
         }
         stack += getName();
-        for (TokenVector::iterator i = children_.begin(); i != children_.end(); i++) {
-          if (string((*i)->getName()) == string(argv[1]))
-            return (*i)->parse_w(argc-1, &argv[1], root, stack.c_str());
+        Token* child = findChild(argv[next]);
+        if (child)
+          return child->parse_w(argc-next, &argv[next], root, stack.c_str());
+        vector<char> buf;
+        vector<char*> words;
+        child = findAssignment(argv[next], buf, words);
+        if (child) {
+          words.insert(words.end(), &argv[next+1], &argv[argc]);
+          return child->parse_w(words.size(), &words[0], root, stack.c_str());
         }
         if (argchild_)
-          return static_cast<Token*>(argchild_)->parse_w(argc-1, &argv[1], root, stack.c_str());
+          return static_cast<Token*>(argchild_)->parse_w(argc-next, &argv[next], root, stack.c_str());
         else if (!children_.size()) {
           throw ParseException(where, "Too many arguments", root, history);
         } else
           throw ParseException(where, "Wrong argument", root, history);
-      } else if (mayTerminate_) {
+      } else if (mayTerminate_ or next > 1) {
+        // Trailing bare flags end the line, as a single flag word used to
         return Result::SUCCESS;
       } else if (argchild_ or children_.size() != 0) {
         throw ParseException(where, "Not enough arguments", root, history);
       } else return Result::SUCCESS;
     }
 
+    // Same walk as parse_w, but touching no token state and running no
+    // commands, so several threads may validate against one tree at once.
+    // If path is given, every token reached is appended to it along with
+    // its word and the flags parse_w would have set on it.
+    const Token* validate(const Token* where, int argc, char* argv[], const char*& what, PlanPath* path = NULL) const {
+      vector<unsigned long>* bits = NULL;
+      if (path) {
+        path->push_back(PlanStep(const_cast<Token*>(where), argc > 0 ? argv[0] : "", flagBits_.size()));
+        bits = &path->back().flags_;
+      }
+      int next = 1 + takeFlags(argc, argv, bits);
+      if (argc > next) {
+        vector<char> buf;
+        vector<char*> words;
+        Token* child = findChild(argv[next]);
+        if (!child) {
+          child = findAssignment(argv[next], buf, words);
+          if (child) words.insert(words.end(), &argv[next+1], &argv[argc]);
+        }
+        if (child) {
+          FlagVector::const_iterator flag = find(flags_.begin(), flags_.end(), child);
+          if (bits and flag != flags_.end())
+            setBit(*bits, flag - flags_.begin());
+          if (words.empty())
+            return child->pimpl_->validate(child, argc-next, &argv[next], what, path);
+          return child->pimpl_->validate(child, words.size(), &words[0], what, path);
+        }
+        if (argchild_) {
+          const Token* arg = argchild_;
+          return arg->pimpl_->validate(arg, argc-next, &argv[next], what, path);
+        } else if (!children_.size())
+          what = "Too many arguments";
+        else
+          what = "Wrong argument";
+        return where;
+      } else if (mayTerminate_ or next > 1 or !(argchild_ or children_.size() != 0)) {
+        return NULL;
+      } else {
+        what = "Not enough arguments";
+        return where;
+      }
+    }
+
     const char* getName() const { return name_.c_str(); }
     const char* getHelp() const { return help_.c_str(); }
     
@@ -201,20 +346,44 @@ namespace treeconf {
       child->addTo(father);
     }
 
-    Token* findChild(const char* rec) {
-      for (TokenVector::iterator i = children_.begin(); i != children_.end(); i++) {
-        if (string((*i)->getName()) == string(rec))
-          return *i;
-      }
-      return NULL;
-    }
-
     void addTo(Token* child, Token* father) { father->pimpl_->children_.push_back(child); }
     void addToAsArg(Argument* child, Token* father) { father->pimpl_->argchild_=child; }
+    unsigned int addToAsFlag(Flag* child, Token* father) {
+      TokenImpl* f = father->pimpl_;
+      f->children_.push_back(child);
+      f->flags_.push_back(child);
+      f->flagBits_.resize((f->flags_.size() + FLAG_WORD_BITS - 1) / FLAG_WORD_BITS, 0);
+      return f->flags_.size() - 1;
+    }
+    static void setFlag(Token* father, unsigned int bit) { setBit(father->pimpl_->flagBits_, bit); }
+    void setFlags(const vector<unsigned long>& bits) { flagBits_ = bits; }
+    static void fail(const Token* where, const char* what, const Token* root) throw (TokenException) {
+      throw ParseException(where, what, root, NULL);
+    }
+    unsigned long getFlags(unsigned int word) const {
+      return word < flagBits_.size() ? flagBits_[word] : 0;
+    }
+    size_t getFlagWords() const { return flagBits_.size(); }
+
+    // Set by the Argument and Command constructors, so that walking a
+    // PlanPath needs no dynamic_cast
+    void setKind(Argument* argument, Command* command) { argument_ = argument; command_ = command; }
+    Argument* asArgument() const { return argument_; }
+    Command* asCommand() const { return command_; }
 
+    // Bare flags keep no state of their own, clearing flagBits_ resets them
     void init() {
-      for (TokenVector::iterator i = children_.begin(); i != children_.end(); i++)
+      fill(flagBits_.begin(), flagBits_.end(), 0);
+      FlagVector::const_iterator flag = flags_.begin();
+      for (TokenVector::iterator i = children_.begin(); i != children_.end(); i++) {
+        if (flag != flags_.end() and *i == *flag) {
+          flag++;
+          if ((*i)->pimpl_->isBare()) continue;
+        }
         (*i)->init();
+      }
+      if (argchild_)
+        static_cast<Token*>(argchild_)->init();
     }
 
   };
@@ -241,11 +410,13 @@ namespace treeconf {
   void Token::push(Token* child) { pimpl_->push(this, child); }
   void Token::addTo(Token* father) { pimpl_->addTo(this, father); }
   void Token::init() { pimpl_->init(); }
+  unsigned long Token::getFlags(unsigned int word) const { return pimpl_->getFlags(word); }
     
   // Argument implementation
   // 
   class ArgumentImpl {
     friend class Argument;
+    friend class PlanImpl;
     string text_;
     
     ArgumentImpl() : text_("") {}
@@ -256,7 +427,7 @@ namespace treeconf {
     
   };
   Argument::Argument(const char* name, const char* help, bool mayTerminate)
-    : Token(name, help, mayTerminate), pimpl_(new ArgumentImpl()) {}
+    : Token(name, help, mayTerminate), pimpl_(new ArgumentImpl()) { getPimpl()->setKind(this, NULL); }
   Argument::~Argument() { delete pimpl_; }
   const Result Argument::parse_w(int argc, char* argv[], Token* root, const char* history) throw (Result, TokenException) {
     pimpl_->setText(argv[0]);
@@ -264,30 +435,40 @@ namespace treeconf {
   }
   const char* Argument::getText() const { return pimpl_->getText(); }
   void Argument::addTo(Token* father) { getPimpl()->addToAsArg(this, father); }
-  void Argument::init() {pimpl_->setText("");}
+  void Argument::init() { pimpl_->setText(""); Token::init(); }
 
   // Flag implementation
-  // 
+  //
+  // The state of a flag lives in a bitset of the token it was pushed
+  // onto, so all flags of a token are reset at once and can be tested in
+  // bulk through Token::getFlags().
   class FlagImpl {
     friend class Flag;
-    bool isSet_;
+    Token* father_;
+    unsigned int bit_;
     
-    FlagImpl() : isSet_(false) {}
+    FlagImpl() : father_(NULL), bit_(0) {}
     ~FlagImpl() {}
 
-    void isSet(bool b) { isSet_ = b;}
-    bool isSet() { return isSet_;}
+    bool isSet() const {
+      if (!father_) return false;
+      return father_->getFlags(bit_ / FLAG_WORD_BITS) & (1UL << (bit_ % FLAG_WORD_BITS));
+    }
     
   };
   Flag::Flag(const char* name, const char* help, bool mayTerminate)
     : Token(name, help, mayTerminate), pimpl_(new FlagImpl()) {}
   Flag::~Flag() { delete pimpl_; }
   const Result Flag::parse_w(int argc, char* argv[], Token* root, const char* history) throw (Result, TokenException) {
-    pimpl_->isSet(true);
+    if (pimpl_->father_) TokenImpl::setFlag(pimpl_->father_, pimpl_->bit_);
     return Token::parse_w(argc, argv, root, history);
   }
   bool Flag::isSet() const { return pimpl_->isSet(); }
-  void Flag::init() { pimpl_->isSet(false); }
+  unsigned int Flag::getBit() const { return pimpl_->bit_; }
+  void Flag::addTo(Token* father) {
+    pimpl_->father_ = father;
+    pimpl_->bit_ = getPimpl()->addToAsFlag(this, father);
+  }
 
   // Command implementation
   //
@@ -300,9 +481,377 @@ namespace treeconf {
       return retval;
   }
   Command::Command(const char* name, const char* help, bool mayTerminate)
-    : Token(name, help, mayTerminate), pimpl_(new CommandImpl()) {}
+    : Token(name, help, mayTerminate), pimpl_(new CommandImpl()) { getPimpl()->setKind(NULL, this); }
   Command::~Command() { delete pimpl_; }
 
+  // CommandLine implementation
+  //
+  class CommandLineImpl {
+    friend class CommandLine;
+    vector<char> buf_;
+    vector<char*> words_;
+
+    CommandLineImpl() {}
+    ~CommandLineImpl() {}
+
+    int split(const Token* root, const char* b, const char* e) {
+      buf_.assign(b, e);
+      buf_.push_back('\0');
+      words_.clear();
+      words_.push_back(const_cast<char*>(root->getName()));
+      bool inWord = false;
+      for (vector<char>::iterator c = buf_.begin(); c != buf_.end(); c++) {
+        if (*c == ' ' or *c == '\t' or *c == '\r' or *c == '\0') {
+          *c = '\0';
+          inWord = false;
+        } else if (!inWord) {
+          words_.push_back(&*c);
+          inWord = true;
+        }
+      }
+      int argc = words_.size();
+      words_.push_back(NULL);
+      return argc;
+    }
+  };
+  CommandLine::CommandLine() : pimpl_(new CommandLineImpl()) {}
+  CommandLine::~CommandLine() { delete pimpl_; }
+  int CommandLine::split(const Token* root, const char* begin, const char* end) { return pimpl_->split(root, begin, end); }
+  char** CommandLine::getArgv() { return &pimpl_->words_[0]; }
+
+  // Plan implementation
+  //
+  class PlanImpl {
+    friend class Plan;
+    friend class ImportImpl;
+    Token* root_;
+    PlanPath path_;
+    vector<size_t> args_;       // steps taken by Arguments, in bind() order
+    vector<Command*> commands_; // outermost first
+
+    PlanImpl(Token* root) : root_(root) {}
+    ~PlanImpl() {}
+
+    void prepare(int argc, char* argv[]) throw (Result, TokenException) {
+      path_.clear();
+      args_.clear();
+      commands_.clear();
+      const char* what = NULL;
+      const Token* where = root_->pimpl_->validate(root_, argc, argv, what, &path_);
+      if (where) {
+        path_.clear();
+        TokenImpl::fail(where, what, root_);
+      }
+      index();
+    }
+
+    // Finds the arguments and commands among the steps of path_
+    void index() {
+      args_.clear();
+      commands_.clear();
+      for (PlanPath::iterator i = path_.begin(); i != path_.end(); i++) {
+        if (i->token_->pimpl_->asArgument())
+          args_.push_back(i - path_.begin());
+        Command* command = i->token_->pimpl_->asCommand();
+        if (command)
+          commands_.push_back(command);
+      }
+    }
+
+    PlanStep& getStep(unsigned int i) throw (Result) {
+      if (i >= args_.size())
+        throw Result(Result::FAILURE_CODE, "No such argument in plan");
+      return path_[args_[i]];
+    }
+
+    const Result run() throw (Result, TokenException) {
+      if (path_.empty())
+        throw Result(Result::FAILURE_CODE, "Plan not prepared");
+      // Optional tokens the plan does not reach must not keep the state
+      // of an earlier parse, so reset the tree as parse_w does
+      root_->pimpl_->init();
+      for (PlanPath::const_iterator i = path_.begin(); i != path_.end(); i++)
+        i->token_->pimpl_->setFlags(i->flags_);
+      for (vector<size_t>::const_iterator i = args_.begin(); i != args_.end(); i++)
+        static_cast<Argument*>(path_[*i].token_)->pimpl_->setText(path_[*i].text_.c_str());
+      for (size_t i = commands_.size(); i-- > 0; ) {
+        const Result retval = commands_[i]->run();
+        if (i == 0 or retval.getCode() != Result::SUCCESS_CODE)
+          return retval;
+      }
+      return Result::SUCCESS;
+    }
+  };
+  Plan::Plan(Token* root) : pimpl_(new PlanImpl(root)) {}
+  Plan::~Plan() { delete pimpl_; }
+  void Plan::prepare(int argc, char* argv[]) throw (Result, TokenException) { pimpl_->prepare(argc, argv); }
+  unsigned int Plan::getArguments() const { return pimpl_->args_.size(); }
+  const Argument* Plan::getArgument(unsigned int i) const {
+    return i < pimpl_->args_.size() ? static_cast<const Argument*>(pimpl_->path_[pimpl_->args_[i]].token_) : NULL;
+  }
+  void Plan::bind(unsigned int i, const char* value) throw (Result) { pimpl_->getStep(i).text_.assign(value); }
+  const Result Plan::run() throw (Result, TokenException) { return pimpl_->run(); }
+
+  // Import implementation
+  //
+  struct ImportError {
+    size_t line_;
+    string what_;
+    ImportError(size_t line, const string& what) : line_(line), what_(what) {}
+  };
+  typedef vector<ImportError> ImportErrorVector;
+
+  // The lines resolved in the parallel phase for dispatching are kept
+  // flat in their chunk, so that resolving takes no allocation per line.
+  // Only steps with state to apply or a command to run are kept.
+  struct ImportStep {
+    Token* token_;
+    size_t text_;     // in ImportChunk::texts_, npos unless an Argument
+    size_t flags_;    // in ImportChunk::flags_, npos if no flag is set
+  };
+  struct ImportCommand {
+    size_t line_;
+    size_t step_;     // first of steps_ steps in ImportChunk::steps_
+    size_t steps_;
+  };
+
+  struct ImportChunk {
+    const Token* root_;
+    const char* begin_;
+    const char* end_;
+    size_t lines_;
+    bool dispatching_;
+    ImportErrorVector errors_;          // line numbers relative to begin_
+    vector<ImportCommand> commands_;    // likewise, only if dispatching_
+    vector<ImportStep> steps_;
+    string texts_;
+    vector<unsigned long> flags_;
+    ImportChunk() : root_(NULL), begin_(NULL), end_(NULL), lines_(0), dispatching_(false) {}
+  };
+
+  class ImportMapping {
+    void* addr_;
+    size_t size_;
+  public:
+    ImportMapping(void* addr, size_t size) : addr_(addr), size_(size) {}
+    ~ImportMapping() { munmap(addr_, size_); }
+  };
+
+  class ImportImpl {
+    friend class Import;
+    static const size_t MIN_CHUNK = 1 << 16;
+    static const size_t MAX_CHUNK = 1 << 20;    // when dispatching
+    Token* root_;
+    unsigned int threads_;
+    size_t lines_;
+    ImportErrorVector errors_;
+
+    ImportImpl(Token* root, unsigned int threads) : root_(root), threads_(threads), lines_(0) {
+      if (threads_ == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_ = n > 0 ? n : 1;
+      }
+    }
+    ~ImportImpl() {}
+
+    static const char* endOfLine(const char* b, const char* end) {
+      const char* e = static_cast<const char*>(memchr(b, '\n', end - b));
+      return e ? e : end;
+    }
+
+    // Returns 0 for blank and comment lines
+    static int tokenize(const Token* root, const char* b, const char* e, CommandLine& line) {
+      int argc = line.split(root, b, e);
+      return (argc < 2 or line.getArgv()[1][0] == '#') ? 0 : argc;
+    }
+
+    static void* work(void* arg) {
+      ImportChunk* chunk = static_cast<ImportChunk*>(arg);
+      CommandLine line;
+      PlanPath path;
+      for (const char* b = chunk->begin_; b < chunk->end_; chunk->lines_++) {
+        const char* e = endOfLine(b, chunk->end_);
+        try {
+          int argc = tokenize(chunk->root_, b, e, line);
+          path.clear();
+          const char* what = NULL;
+          const Token* where = argc ? chunk->root_->pimpl_->validate(chunk->root_, argc, line.getArgv(), what,
+                                                                     chunk->dispatching_ ? &path : NULL) : NULL;
+          if (where)
+            chunk->errors_.push_back(ImportError(chunk->lines_ + 1, string(what) + " after \"" + where->getName() + "\""));
+          else if (argc and chunk->dispatching_)
+            keep(chunk, chunk->lines_ + 1, path);
+        } catch (std::exception& ex) {
+          chunk->errors_.push_back(ImportError(chunk->lines_ + 1, ex.what()));
+        }
+        b = e + 1;
+      }
+      return NULL;
+    }
+
+    static void keep(ImportChunk* chunk, size_t line, const PlanPath& path) {
+      ImportCommand command = { line, chunk->steps_.size(), 0 };
+      for (PlanPath::const_iterator i = path.begin(); i != path.end(); i++) {
+        const TokenImpl* token = i->token_->pimpl_;
+        bool arg = token->asArgument() != NULL;
+        bool flags = count(i->flags_.begin(), i->flags_.end(), 0UL) != (ptrdiff_t)i->flags_.size();
+        if (!arg and !flags and !token->asCommand())
+          continue;
+        ImportStep step = { i->token_, string::npos, string::npos };
+        if (arg) {
+          step.text_ = chunk->texts_.size();
+          chunk->texts_.append(i->text_.c_str(), i->text_.size() + 1);
+        }
+        if (flags) {
+          step.flags_ = chunk->flags_.size();
+          chunk->flags_.insert(chunk->flags_.end(), i->flags_.begin(), i->flags_.end());
+        }
+        chunk->steps_.push_back(step);
+      }
+      command.steps_ = chunk->steps_.size() - command.step_;
+      chunk->commands_.push_back(command);
+    }
+
+    // Runs the lines resolved by work() in file order, merging their
+    // errors with those found while resolving. Only the resolved state is
+    // applied to the tree, no line is split or matched again.
+    void dispatch(const ImportChunk& chunk, size_t base) {
+      PlanImpl plan(root_);
+      ImportErrorVector::const_iterator err = chunk.errors_.begin();
+      for (vector<ImportCommand>::const_iterator c = chunk.commands_.begin(); c != chunk.commands_.end(); c++) {
+        for (; err != chunk.errors_.end() and err->line_ < c->line_; err++)
+          errors_.push_back(ImportError(base + err->line_, err->what_));
+        size_t line = base + c->line_;
+        if (!c->steps_) {
+          // Nothing to run, but the tree is still left as parse() would
+          root_->pimpl_->init();
+          continue;
+        }
+        plan.path_.clear();
+        for (size_t i = c->step_; i < c->step_ + c->steps_; i++) {
+          const ImportStep& step = chunk.steps_[i];
+          const char* text = step.text_ == string::npos ? "" : chunk.texts_.c_str() + step.text_;
+          plan.path_.push_back(PlanStep(step.token_, text, step.token_->pimpl_->getFlagWords()));
+          if (step.flags_ != string::npos)
+            copy(&chunk.flags_[step.flags_], &chunk.flags_[step.flags_] + plan.path_.back().flags_.size(),
+                 plan.path_.back().flags_.begin());
+        }
+        plan.index();
+        try {
+          const Result retval = plan.run();
+          if (retval.getCode() != Result::SUCCESS_CODE)
+            errors_.push_back(ImportError(line, retval.what()));
+        } catch (ParseException& e) {
+          errors_.push_back(ImportError(line, string(e.what()) + " after \"" + e.where()->getName() + "\""));
+        } catch (RunException& e) {
+          errors_.push_back(ImportError(line, string(e.what()) + " for command \"" + e.where()->getName() + "\""));
+        } catch (Result& e) {
+          if (e.getCode() != Result::SUCCESS_CODE)
+            errors_.push_back(ImportError(line, e.what()));
+        }
+      }
+      for (; err != chunk.errors_.end(); err++)
+        errors_.push_back(ImportError(base + err->line_, err->what_));
+    }
+
+    const Result load(const char* path, bool dispatching) throw (Result) {
+      lines_ = 0;
+      errors_.clear();
+
+      int fd = open(path, O_RDONLY);
+      if (fd < 0)
+        throw Result(Result::FAILURE_CODE, (string("Cannot open \"") + path + "\"").c_str());
+      struct stat st;
+      if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw Result(Result::FAILURE_CODE, (string("Cannot stat \"") + path + "\"").c_str());
+      }
+      size_t size = st.st_size;
+      if (size == 0) {
+        close(fd);
+        return Result::SUCCESS;
+      }
+      void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (addr == MAP_FAILED)
+        throw Result(Result::FAILURE_CODE, (string("Cannot map \"") + path + "\"").c_str());
+      ImportMapping mapping(addr, size);
+      madvise(addr, size, MADV_SEQUENTIAL);
+      const char* data = static_cast<const char*>(addr);
+      const char* end = data + size;
+
+      // Resolved lines are held until they are dispatched, so a large
+      // file is then taken a few chunks at a time
+      size_t round = dispatching ? threads_ * MAX_CHUNK : size;
+      for (const char* b = data; b < end; ) {
+        const char* e = nextLine(b + min(round, (size_t)(end - b)), b, end);
+        load(b, e, dispatching);
+        b = e;
+      }
+
+      if (errors_.empty())
+        return Result::SUCCESS;
+      stringstream ss;
+      ss << errors_.size() << " errors importing \"" << path << "\"";
+      return Result(Result::FAILURE_CODE, ss.str().c_str());
+    }
+
+    // Moves p just after the end of its line, unless it is at b or end
+    static const char* nextLine(const char* p, const char* b, const char* end) {
+      if (p > b and p < end) {
+        p = endOfLine(p - 1, end);
+        if (p < end) p++;
+      }
+      return p;
+    }
+
+    void load(const char* data, const char* end, bool dispatching) {
+      // Cut chunks of roughly equal size, each ending just after a newline
+      size_t size = end - data;
+      size_t n = size / MIN_CHUNK + 1;
+      if (n > threads_) n = threads_;
+      vector<ImportChunk> chunks(n);
+      const char* b = data;
+      for (size_t i = 0; i < n; i++) {
+        const char* e = (i == n - 1) ? end : data + size / n * (i + 1);
+        e = e < b ? b : nextLine(e, b, end);
+        chunks[i].root_ = root_;
+        chunks[i].dispatching_ = dispatching;
+        chunks[i].begin_ = b;
+        chunks[i].end_ = e;
+        b = e;
+      }
+
+      // Chunks whose thread could not be started are handled inline
+      vector<pthread_t> tids(n);
+      vector<bool> started(n, false);
+      for (size_t i = 1; i < n; i++)
+        started[i] = pthread_create(&tids[i], NULL, work, &chunks[i]) == 0;
+      work(&chunks[0]);
+      for (size_t i = 1; i < n; i++) {
+        if (started[i]) pthread_join(tids[i], NULL);
+        else work(&chunks[i]);
+      }
+
+      // Merge in file order
+      for (size_t i = 0; i < n; i++) {
+        if (dispatching)
+          dispatch(chunks[i], lines_);
+        else
+          for (ImportErrorVector::const_iterator err = chunks[i].errors_.begin(); err != chunks[i].errors_.end(); err++)
+            errors_.push_back(ImportError(lines_ + err->line_, err->what_));
+        lines_ += chunks[i].lines_;
+      }
+    }
+  };
+  Import::Import(Token* root, unsigned int threads) : pimpl_(new ImportImpl(root, threads)) {}
+  Import::~Import() { delete pimpl_; }
+  const Result Import::load(const char* path, bool dispatch) throw (Result) { return pimpl_->load(path, dispatch); }
+  size_t Import::getLines() const { return pimpl_->lines_; }
+  size_t Import::getErrors() const { return pimpl_->errors_.size(); }
+  size_t Import::getErrorLine(size_t i) const { return pimpl_->errors_.at(i).line_; }
+  const char* Import::getError(size_t i) const { return pimpl_->errors_.at(i).what_.c_str(); }
+
 }
 
   
@@ -7,6 +7,8 @@ static char *rcsid = "$Id: deleteshmem.cc,v 1.4 2009/01/16 15:17:13 jromera Exp
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <fstream>
+#include <cstring>
 
 using namespace std;
 using namespace treeconf;
@@ -53,7 +55,7 @@ class LampController : public Token {
     Lamp* const lamp;
 
   public:
-    OnOffSwitch(Lamp& l) : Command("toggle", false, "Switch from ON to OFF or vice versa"), lamp(&l) {}
+    OnOffSwitch(Lamp& l) : Command("toggle", "Switch from ON to OFF or vice versa"), lamp(&l) {}
 
     const Result run () throw (RunException){
       if (lamp->isOn()) lamp->turnOff(); else lamp->turnOn();
@@ -67,7 +69,7 @@ class LampController : public Token {
     Argument darg;
 
   public:
-    Dimmer(Lamp& l) : Command("dim", true, "Dim lights"), lamp(&l), darg("<dim_value>", false, "A percentage between 0 and 100 ") {
+    Dimmer(Lamp& l) : Command("dim", "Dim lights", true), lamp(&l), darg("<dim_value>", "A percentage between 0 and 100 ") {
       push(&darg);
     }
 
@@ -99,6 +101,52 @@ public:
 
 };
 
+class Status : public Command {
+  Lamp* const lamp;
+  Flag verbose;
+  Flag name;
+  Flag quiet;
+  Flag label;
+  Argument labelText;
+
+public:
+  Status(Lamp& l) : Command("status", "Show lamp state", true), lamp(&l),
+                    verbose("-v", "Say more"), name("-n", "Show name"), quiet("--quiet", "Exit code only"),
+                    label("--label", "Show a label"), labelText("<text>") {
+    push(&verbose);
+    push(&name);
+    push(&quiet);
+    push(&label);
+    label.push(&labelText);
+  }
+
+  const Result run () throw (RunException){
+    if (quiet.isSet())
+      return Result(lamp->isOn() ? 0 : 1, "");
+    if (label.isSet()) cout << labelText.getText() << " ";
+    if (name.isSet()) cout << lamp->getName() << ": ";
+    cout << (lamp->isOn() ? "ON" : "OFF");
+    if (verbose.isSet()) cout << " (flags " << getFlags() << ")";
+    cout << "\n";
+    return Result(0, "Status shown");
+  }
+
+  const char* getLabel() const { return labelText.getText(); }
+};
+
+class Blink : public Command {
+  Flag fast;
+
+public:
+  Blink() : Command("blink", "Blink the lamp"), fast("-f", "Blink fast") {
+    push(&fast);
+  }
+
+  const Result run () throw (RunException){
+    return Result(0, fast.isSet() ? "Blinking fast" : "Blinking");
+  }
+};
+
 typedef map<string, Lamp*> LampMap;
 
 class ArgSwitch : Command {
@@ -106,7 +154,7 @@ class ArgSwitch : Command {
   LampMap* lampMap_;
 
 public:
-  ArgSwitch(Argument* whatLamp, LampMap* lmap) : Command("toggle", false, "Switch from ON to OFF and vice versa"),
+  ArgSwitch(Argument* whatLamp, LampMap* lmap) : Command("toggle", "Switch from ON to OFF and vice versa"),
                                                  whatLamp_(whatLamp),
                                                  lampMap_(lmap)
   {
@@ -132,9 +180,9 @@ class ArgDimmer : Command {
   LampMap* lampMap_;
 
 public:
-  ArgDimmer(Argument* whatLamp, LampMap* lmap) : Command("dim", false, "Dim lights"),
+  ArgDimmer(Argument* whatLamp, LampMap* lmap) : Command("dim", "Dim lights"),
                                                  whatLamp_(whatLamp),
-                                                 darg_("<dim_value>", false, "A percentage between 0 and 100"),
+                                                 darg_("<dim_value>", "A percentage between 0 and 100"),
                                                  lampMap_(lmap)
   {
     whatLamp_->push(this);
@@ -164,9 +212,9 @@ class TArgDimmer : Command {
   TArgument<float> darg_;
 
 public:
-  TArgDimmer(TArgument<Lamp*> *whatLamp, LampMap* lmap) : Command("dim", false, "Dim lights"),
+  TArgDimmer(TArgument<Lamp*> *whatLamp, LampMap* lmap) : Command("dim", "Dim lights"),
                                                           whatLamp_(whatLamp),
-                                                          darg_("<dim_value>", false, "A percentage between 0 and 100")
+                                                          darg_("<dim_value>", "A percentage between 0 and 100")
   {
     whatLamp_->push(this);
     push(&darg_);
@@ -201,6 +249,11 @@ void testParse(Token& tok, int argc, char* argv[]) {
   }
 }
 
+int check(bool ok, const char* what) {
+  if (!ok) cerr << string() + "FAILED: " + what + "\n";
+  return ok ? 0 : 1;
+}
+
 int test1(int argc, char* argv[]) {
   cout << "Test 1\n\n";
   Token root("lighting");
@@ -229,7 +282,7 @@ int test2(int argc, char* argv[]) {
   lmap.insert(make_pair(l1.getName(), &l1));
   lmap.insert(make_pair(l2.getName(), &l2));
 
-  Argument lampArg("<lamp name>", false, "Name of lamp to control");
+  Argument lampArg("<lamp name>", "Name of lamp to control");
   ArgDimmer argDim(&lampArg, &lmap);
   ArgSwitch argSwitch(&lampArg, &lmap);
 
@@ -251,7 +304,7 @@ int test3(int argc, char* argv[]) {
   lmap.insert(make_pair(l1.getName(), &l1));
   lmap.insert(make_pair(l2.getName(), &l2));
 
-  TArgument<Lamp*> lampArg("<lamp name>", false, "Name of the lamp to control");
+  TArgument<Lamp*> lampArg("<lamp name>", "Name of the lamp to control");
   TArgDimmer argDim(&lampArg, &lmap);
   ArgSwitch argSwitch(&lampArg, &lmap);
 
@@ -274,23 +327,166 @@ bool operator>>(const Argument& lhs, Lamp*& rhs) throw (RunException){
   throw RunException(&lhs, (string() + "Could not find a lamp named \"" + lhs.getText() + "\"").c_str());
 }
 
-bool operator>>(const Argument& lhs, float& rhs) throw (RunException){
-  string tmp;
-  stringstream ss(lhs.getText());
-  if (ss >> rhs) {
-    return true;
+// Only found by argument dependent lookup from TArgument::getValue when
+// declared next to Argument
+namespace treeconf {
+  bool operator>>(const Argument& lhs, float& rhs) throw (RunException){
+    string tmp;
+    stringstream ss(lhs.getText());
+    if (ss >> rhs) {
+      return true;
+    }
+    throw RunException(&lhs, (string() + "Could not convert \"" + lhs.getText() + "\"").c_str());
   }
-  throw RunException(&lhs, (string() + "Could not convert \"" + lhs.getText() + "\"").c_str());
 }
 
+int test4() {
+  cout << "Test 4\n\n";
+  Token root("lighting");
+
+  Lamp l1("lamp1");
+  Lamp l2("lamp2");
+
+  LampController lc1(l1);
+  LampController lc2(l2);
+
+  root.push(&lc1);
+  root.push(&lc2);
+
+  const char* path = "treeconf_test_import.txt";
+  ofstream out(path);
+  out << "# lighting script\n"
+      << "lamp1 toggle\n"
+      << "lamp2 dim 30\n"
+      << "\n"
+      << "lamp3 toggle\n"
+      << "lamp2 dim\n"
+      << "lamp1 dim abc\n";
+  out.close();
+
+  Import import(&root);
+  Result retval = import.load(path, true);
+  cout << "Imported " << import.getLines() << " lines: \"" << retval.what() << "\"\n";
+  for (size_t i = 0; i < import.getErrors(); i++)
+    cerr << path << ":" << import.getErrorLine(i) << ": " << import.getError(i) << "\n";
+  remove(path);
+
+  int failures = 0;
+  failures += check(import.getLines() == 7, "import counts every line");
+  failures += check(import.getErrors() == 2, "import reports two errors");
+  failures += check(import.getErrors() == 2 and import.getErrorLine(0) == 5 and import.getErrorLine(1) == 7,
+                    "import errors carry their line numbers, in file order");
+  failures += check(l1.isOn(), "import dispatches valid lines");
+  failures += check(import.getErrors() == 2 and string(import.getError(1)) == "Cannot convert \"abc\" to dim value for command \"dim\"",
+                    "dispatched commands see the arguments of their line");
+  return failures;
+}
+// Returns the result code, or -2 for a parse error
+int parseLine(Token& root, const char* line) {
+  CommandLine words;
+  int argc = words.split(&root, line, line + strlen(line));
+  try {
+    return root.parse(argc, words.getArgv()).getCode();
+  } catch (ParseException& e) {
+    cerr << string() + "Caught ParseException: " + e.what() + " after \""+ e.where()->getName() + "\"\n";
+    return -2;
+  } catch (Result& e) {
+    return e.getCode();
+  }
+}
+
+int test5() {
+  cout << "Test 5\n\n";
+  Token root("lighting");
+
+  Lamp l1("lamp1");
+  Status status(l1);
+  Blink blink;
+  root.push(&status);
+  root.push(&blink);
+
+  int failures = 0;
+  failures += check(parseLine(root, "status -vn") == 0 and status.getFlags() == 3, "bundled flags are all set");
+  failures += check(parseLine(root, "status -n --quiet") == 1 and status.getFlags() == 6, "separate flags are all set");
+  failures += check(parseLine(root, "status -vx") == -2, "a bundle with an unknown flag is refused");
+  failures += check(parseLine(root, "status --label=kitchen") == 0 and status.getFlags() == 8,
+                    "--name=value reaches the argument of --name");
+  failures += check(parseLine(root, "status -v") == 0 and status.getFlags() == 1 and string(status.getLabel()).empty(),
+                    "flags and flag arguments of an earlier parse are reset");
+  failures += check(parseLine(root, "blink -f") == 0 and blink.getFlags() == 1, "a flag may end a command that only has flags");
+  failures += check(parseLine(root, "blink") == -2, "a command that only has flags still needs one");
+  return failures;
+}
+
+int test6() {
+  cout << "Test 6\n\n";
+  Token root("lighting");
+
+  Lamp l1("lamp1");
+  Lamp l2("lamp2");
+
+  LampController lc1(l1);
+  LampController lc2(l2);
+
+  root.push(&lc1);
+  root.push(&lc2);
+
+  int failures = 0;
+  char* dim[] = { (char*)"lighting", (char*)"lamp1", (char*)"dim", (char*)"0" };
+  char* dimDefault[] = { (char*)"lighting", (char*)"lamp1", (char*)"dim" };
+  Plan plan(&root);
+  Plan planDefault(&root);
+  try {
+    plan.prepare(4, dim);
+    failures += check(plan.getArguments() == 1, "the plan has one argument to bind");
+    const char* values[] = { "10", "20" };
+    for (int i = 0; i < 2; i++) {
+      plan.bind(0, values[i]);
+      failures += check(string(plan.run().what()) == "Lamp dimmed successfully", "the plan runs with the bound value");
+    }
+    plan.bind(0, "abc");
+    plan.run();
+    failures += check(false, "a bad bound value should reach the command");
+  } catch (ParseException& e) {
+    failures += check(false, "the plan prepares");
+  } catch (RunException& e) {
+    cerr << string("Caught RunException: ") + e.what() + " for command \"" + e.where()->getName() + "\"\n";
+  }
+
+  // An argument left out of the plan must not keep an earlier value
+  parseLine(root, "lamp1 dim 30");
+  try {
+    planDefault.prepare(3, dimDefault);
+    failures += check(string(planDefault.run().what()) == "Lamp dimmed successfully to default value",
+                      "an optional argument outside the plan is reset");
+  } catch (ParseException& e) {
+    failures += check(false, "the plan with a default prepares");
+  }
+
+  // Like parse(), an empty command line is refused, not a crash
+  Plan planEmpty(&root);
+  char* empty[] = { NULL };
+  try {
+    planEmpty.prepare(0, empty);
+    failures += check(false, "an empty plan should be refused");
+  } catch (ParseException& e) {
+    failures += check(string(e.what()) == "Not enough arguments", "an empty plan is refused like an empty parse");
+  }
+  return failures;
+}
 
 int
 main(int argc, char **argv)
 {
 
+  int failures = 0;
   test1(argc, argv);
   test2(argc, argv);
   test3(argc, argv);
+  failures += test4();
+  failures += test5();
+  failures += test6();
   cout << "\nShould not be destroying anything\n"; 
+  return failures ? 1 : 0;
 
 }